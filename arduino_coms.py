@@ -2,12 +2,26 @@ import socket
 import time
 import json  
 import os     
+import heapq
+import math
+import re
+from itertools import permutations
+from collections import deque
 
 # Configure the Ethernet connection
 arduino_ip = '192.168.100.115'  # Change this to your Arduino's IP address
 arduino_port = 80  # Change this to your Arduino's port if different
 buffer_size = 1024
 
+# Motion model of the firmware (see arduino_firmware/src/main.cpp), used to estimate travel time
+step_delay_a_us = 1000  # Step delay of Motor A in microseconds
+step_delay_b_us = 1000  # Step delay of Motor B in microseconds
+simultaneous_axes = False  # The firmware moves Motor A first, then Motor B
+start_pos_a = 2716  # Position of Motor A after homing (START_POS_A)
+start_pos_b = 619   # Position of Motor B after homing (START_POS_B)
+exact_block_size = 6  # Blocks with at most this many scan points are solved by trying every ordering
+work_check_interval = 2000  # Grid cells and points examined between deadline checks
+
 def send_command(command):
     """
     Send a command to the Arduino and print the response.
@@ -30,7 +44,396 @@ def send_command(command):
         except socket.error as e:
             return f"Socket error: {e}"
 
-def interpret_command(positions):
+def get_current_position():
+    """
+    Ask the Arduino for the current motor positions with GETPOS.
+
+    Returns:
+        tuple: (pos_a, pos_b) as ints, or None if the response could not be parsed.
+    """
+    response = send_command("GETPOS")
+    match = re.search(r"Motor A Position: (-?\d+), Motor B Position: (-?\d+)", response)
+    if not match:
+        return None
+    return int(match.group(1)), int(match.group(2))
+
+def _is_scan_point(entry):
+    return isinstance(entry, dict) and 'pos_a' in entry and 'pos_b' in entry and not entry.get('home')
+
+def _move_time(xa, ya, xb, yb, simultaneous):
+    # Coordinates are pre-scaled to seconds, so the axes are directly comparable
+    dx = abs(xa - xb)
+    dy = abs(ya - yb)
+    return max(dx, dy) if simultaneous else dx + dy
+
+def estimate_scan_time(positions, start=None, simultaneous=None,
+                       step_delay_a=None, step_delay_b=None):
+    """
+    Estimate the time the motors spend travelling through a scan list.
+
+    Args:
+        positions (list or dict): Scan entries in the same format as for interpret_command.
+        start (tuple): (pos_a, pos_b) before the first entry. Defaults to the homed start position.
+        simultaneous (bool): True if both axes move at the same time. Defaults to simultaneous_axes.
+        step_delay_a (int or float): Step delay of Motor A in microseconds. Defaults to step_delay_a_us.
+        step_delay_b (int or float): Step delay of Motor B in microseconds. Defaults to step_delay_b_us.
+    Returns:
+        float: Estimated travel time in seconds. Homing and communication overhead are not included.
+    """
+    if not isinstance(positions, list):
+        positions = [positions]
+    simultaneous = simultaneous_axes if simultaneous is None else simultaneous
+    scale_a = (step_delay_a_us if step_delay_a is None else step_delay_a) * 1e-6
+    scale_b = (step_delay_b_us if step_delay_b is None else step_delay_b) * 1e-6
+    pos_a, pos_b = start if start is not None else (start_pos_a, start_pos_b)
+
+    total = 0.0
+    for entry in positions:
+        if isinstance(entry, dict) and entry.get('home'):
+            pos_a, pos_b = start_pos_a, start_pos_b
+        elif _is_scan_point(entry):
+            total += _move_time(pos_a * scale_a, pos_b * scale_b,
+                                entry['pos_a'] * scale_a, entry['pos_b'] * scale_b, simultaneous)
+            pos_a, pos_b = entry['pos_a'], entry['pos_b']
+    return total
+
+class _PointGrid:
+    """
+    Bucket grid over the scaled points, used for fast nearest neighbor queries.
+    """
+    def __init__(self, xs, ys, min_cell):
+        self.xs = xs
+        self.ys = ys
+        n = len(xs)
+        self.min_x = min(xs)
+        self.min_y = min(ys)
+        width = max(xs) - self.min_x
+        height = max(ys) - self.min_y
+        # Aim for roughly two points per cell, but never less than one motor step
+        self.cell = max(math.sqrt(width * height * 2 / n), max(width, height) * 2 / n, min_cell) or 1.0
+        self.cols = int(width / self.cell) + 1
+        self.rows = int(height / self.cell) + 1
+        self.cells = {}
+        self.work = 0  # Cells and points examined by nearest, used to pace deadline checks
+        for i in range(n):
+            self.cells.setdefault(self._cell_of(xs[i], ys[i]), set()).add(i)
+
+    def _cell_of(self, x, y):
+        return (math.floor((x - self.min_x) / self.cell), math.floor((y - self.min_y) / self.cell))
+
+    def remove(self, i):
+        key = self._cell_of(self.xs[i], self.ys[i])
+        bucket = self.cells[key]
+        bucket.discard(i)
+        if not bucket:
+            del self.cells[key]
+
+    def _ring(self, cx, cy, r):
+        if r == 0:
+            yield (cx, cy)
+            return
+        for gx in range(max(cx - r, 0), min(cx + r, self.cols - 1) + 1):
+            if cy - r >= 0:
+                yield (gx, cy - r)
+            if cy + r < self.rows:
+                yield (gx, cy + r)
+        for gy in range(max(cy - r + 1, 0), min(cy + r - 1, self.rows - 1) + 1):
+            if cx - r >= 0:
+                yield (cx - r, gy)
+            if cx + r < self.cols:
+                yield (cx + r, gy)
+
+    def nearest(self, x, y, k, simultaneous, exclude=None):
+        """
+        Return up to k (time, index) pairs closest to (x, y), sorted by time.
+        """
+        cx, cy = self._cell_of(x, y)
+        max_r = max(cx, self.cols - 1 - cx, cy, self.rows - 1 - cy)
+        # Rings closer than this lie entirely outside the grid when the query point is outside it
+        min_r = max(0, -cx, cx - (self.cols - 1), -cy, cy - (self.rows - 1))
+        best = []  # Max-heap of (-time, index)
+        for r in range(min_r, max_r + 1):
+            for key in self._ring(cx, cy, r):
+                self.work += 1
+                bucket = self.cells.get(key)
+                if not bucket:
+                    continue
+                self.work += len(bucket)
+                for j in bucket:
+                    if j == exclude:
+                        continue
+                    d = _move_time(x, y, self.xs[j], self.ys[j], simultaneous)
+                    if len(best) < k:
+                        heapq.heappush(best, (-d, j))
+                    elif d < -best[0][0]:
+                        heapq.heapreplace(best, (-d, j))
+            # Every point beyond ring r is at least r cells away along one axis
+            if len(best) == k and -best[0][0] <= r * self.cell:
+                break
+        return sorted((-d, j) for d, j in best)
+
+def _serpentine_orders(xs, ys):
+    """
+    Return candidate serpentine orderings if the points form a full rectangular grid, otherwise [].
+    """
+    n = len(xs)
+    if len(set(zip(xs, ys))) != n:
+        return []
+    values_x = sorted(set(xs))
+    values_y = sorted(set(ys))
+    if len(values_x) * len(values_y) != n:
+        return []
+
+    index = {(xs[i], ys[i]): i for i in range(n)}
+    orders = []
+    for outer, inner, outer_is_x in ((values_x, values_y, True), (values_y, values_x, False)):
+        for outer_values in (outer, outer[::-1]):
+            for first_inner in (inner, inner[::-1]):
+                order = []
+                for row, o in enumerate(outer_values):
+                    line = first_inner if row % 2 == 0 else first_inner[::-1]
+                    order.extend(index[(o, v) if outer_is_x else (v, o)] for v in line)
+                orders.append(order)
+    return orders
+
+def _sweep_order(indices, xs, ys, x0, y0):
+    """
+    Order points in a boustrophedon sweep: strips along pos_a, alternating direction along pos_b.
+    """
+    if not indices:
+        return []
+    min_x = min(xs[i] for i in indices)
+    max_x = max(xs[i] for i in indices)
+    min_y = min(ys[i] for i in indices)
+    max_y = max(ys[i] for i in indices)
+    width = max(max_x - min_x, 0.0)
+    height = max(max_y - min_y, 0.0)
+    strip = math.sqrt(width * height * 2 / len(indices)) or width or 1.0
+    # Start at the strip and end of the strip closest to (x0, y0)
+    reverse_strips = abs(x0 - max_x) < abs(x0 - min_x)
+    descending_first = abs(y0 - max_y) < abs(y0 - min_y)
+
+    def key(i):
+        s = int((xs[i] - min_x) / strip)
+        if reverse_strips:
+            s = -s
+        descending = (s % 2 == 1) != descending_first
+        return (s, -ys[i] if descending else ys[i])
+
+    return sorted(indices, key=key)
+
+def _nearest_neighbor_order(xs, ys, x0, y0, simultaneous, deadline, min_cell):
+    grid = _PointGrid(xs, ys, min_cell)
+    order = []
+    visited = [False] * len(xs)
+    x, y = x0, y0
+    next_check = 0
+    for _ in range(len(xs)):
+        if grid.work >= next_check:
+            next_check = grid.work + work_check_interval
+            if time.perf_counter() > deadline:
+                # Out of time: sweep through the remaining points
+                rest = [i for i in range(len(xs)) if not visited[i]]
+                order.extend(_sweep_order(rest, xs, ys, x, y))
+                break
+        _, j = grid.nearest(x, y, 1, simultaneous)[0]
+        grid.remove(j)
+        visited[j] = True
+        order.append(j)
+        x, y = xs[j], ys[j]
+    return order
+
+def _two_opt(order, xs, ys, x0, y0, simultaneous, deadline, min_cell, neighbors=8):
+    """
+    Improve an open path starting at (x0, y0) with 2-opt moves restricted to each point's nearest neighbors.
+    """
+    n = len(order)
+    if n < 3:
+        return order
+    # Node n is the fixed start position and always stays at tour index 0
+    px = list(xs) + [x0]
+    py = list(ys) + [y0]
+    tour = [n] + list(order)
+    pos = [0] * (n + 1)
+    for i, node in enumerate(tour):
+        pos[node] = i
+    m = n + 1
+    if time.perf_counter() > deadline:
+        return order
+
+    grid = _PointGrid(xs, ys, min_cell)
+    nbrs = []
+    next_check = 0
+    for i in range(n):
+        if grid.work >= next_check:
+            next_check = grid.work + work_check_interval
+            if time.perf_counter() > deadline:
+                return order
+        nbrs.append([j for _, j in grid.nearest(xs[i], ys[i], neighbors, simultaneous, exclude=i)])
+
+    def dist(a, b):
+        return _move_time(px[a], py[a], px[b], py[b], simultaneous)
+
+    def gain(lo, hi):
+        # Reversing tour[lo+1..hi] replaces edges (lo, lo+1) and (hi, hi+1) with (lo, hi) and (lo+1, hi+1)
+        a, b, c = tour[lo], tour[lo + 1], tour[hi]
+        g = dist(a, b) - dist(a, c)
+        if hi + 1 < m:
+            d = tour[hi + 1]
+            g += dist(c, d) - dist(b, d)
+        return g
+
+    def reverse(lo, hi):
+        i, j = lo + 1, hi
+        while i < j:
+            tour[i], tour[j] = tour[j], tour[i]
+            pos[tour[i]] = i
+            pos[tour[j]] = j
+            i += 1
+            j -= 1
+
+    queue = deque(range(n))
+    queued = [True] * n
+    while queue:
+        if time.perf_counter() > deadline:
+            break
+        a = queue.popleft()
+        queued[a] = False
+        i = pos[a]
+        d_next = dist(a, tour[i + 1]) if i + 1 < m else float('inf')
+        d_prev = dist(a, tour[i - 1])
+        improved = None
+        for c in nbrs[a]:
+            d_ac = dist(a, c)
+            if d_ac >= d_next and d_ac >= d_prev:
+                break
+            j = pos[c]
+            # New edge (a, c) replacing the edge after a, or the edge before a
+            for lo, hi in (sorted((i, j)), sorted((i - 1, j - 1))):
+                if lo < 0 or hi <= lo + 1:
+                    continue
+                if gain(lo, hi) > 1e-12:
+                    improved = (lo, hi)
+                    break
+            if improved:
+                break
+        if improved:
+            lo, hi = improved
+            touched = [tour[lo], tour[lo + 1], tour[hi]] + ([tour[hi + 1]] if hi + 1 < m else [])
+            reverse(lo, hi)
+            for node in touched:
+                if node != n and not queued[node]:
+                    queue.append(node)
+                    queued[node] = True
+    return tour[1:]
+
+def _path_time(order, xs, ys, x0, y0, simultaneous):
+    total = 0.0
+    x, y = x0, y0
+    for j in order:
+        total += _move_time(x, y, xs[j], ys[j], simultaneous)
+        x, y = xs[j], ys[j]
+    return total
+
+def optimize_scan_order(positions, start=None, simultaneous=None,
+                        step_delay_a=None, step_delay_b=None, time_limit=0.3):
+    """
+    Reorder a scan list to minimize the estimated travel time of the motors.
+
+    Scan points between two homing entries are reordered freely as one continuous path. Homing
+    entries, and any other entries that do not move the motors, keep their place in the list.
+    Repeated measurements at one location are kept together. Full rectangular grids are tried
+    with serpentine orderings, blocks of up to exact_block_size locations are solved exactly,
+    and every block is also tried with a boustrophedon sweep and a nearest neighbor tour refined
+    by 2-opt. The cheapest candidate is kept, and the original list is returned unchanged if no
+    ordering is faster, so the result is never slower than the input.
+
+    Args:
+        positions (list or dict): Scan entries in the same format as for interpret_command.
+        start (tuple): (pos_a, pos_b) before the first entry. Defaults to the homed start position.
+        simultaneous (bool): True if both axes move at the same time. Defaults to simultaneous_axes.
+        step_delay_a (int or float): Step delay of Motor A in microseconds. Defaults to step_delay_a_us.
+        step_delay_b (int or float): Step delay of Motor B in microseconds. Defaults to step_delay_b_us.
+        time_limit (float): Time budget in seconds for the whole call. Part of it is reserved for the
+            linear work around the search, scaled from one pass over the list. The nearest neighbor
+            and 2-opt steps stop when the rest runs out, and any points not yet visited are
+            finished with a sweep. The call returns within a few hundredths of a second of the
+            budget for lists of up to 20000 points.
+    Returns:
+        tuple: (reordered positions, original travel time, optimized travel time), times in seconds.
+    Example:
+        positions = [{'pos_a': a, 'pos_b': b} for a in range(0, 5800, 200) for b in range(0, 2000, 100)]
+        ordered, before, after = optimize_scan_order(positions)
+        print(f"Saved {before - after:.1f} s")
+        interpret_command(ordered)
+    """
+    deadline = time.perf_counter() + time_limit
+    if not isinstance(positions, list):
+        positions = [positions]
+    simultaneous = simultaneous_axes if simultaneous is None else simultaneous
+    scale_a = (step_delay_a_us if step_delay_a is None else step_delay_a) * 1e-6
+    scale_b = (step_delay_b_us if step_delay_b is None else step_delay_b) * 1e-6
+    start = start if start is not None else (start_pos_a, start_pos_b)
+    min_cell = min(scale_a, scale_b)
+
+    # Reserve time for the linear work after the search (candidate costs, sweeps, the final estimate),
+    # scaled from one linear pass over the list
+    t = time.perf_counter()
+    original = estimate_scan_time(positions, start, simultaneous, step_delay_a, step_delay_b)
+    search_deadline = deadline - 10 * (time.perf_counter() - t)
+
+    result = list(positions)
+    block = []  # Indices of the scan points since the last homing entry
+    pos_a, pos_b = start
+
+    def flush_block():
+        nonlocal pos_a, pos_b
+        if not block:
+            return
+        points = [positions[i] for i in block]
+        xs = [entry['pos_a'] * scale_a for entry in points]
+        ys = [entry['pos_b'] * scale_b for entry in points]
+        x0, y0 = pos_a * scale_a, pos_b * scale_b
+
+        # Repeated measurements at one location cost no travel, so plan over the distinct locations
+        locations = {}
+        for j, entry in enumerate(points):
+            locations.setdefault((entry['pos_a'], entry['pos_b']), []).append(j)
+        keys = list(locations)
+        loc_xs = [a * scale_a for a, _ in keys]
+        loc_ys = [b * scale_b for _, b in keys]
+
+        def expand(order):
+            return [j for k in order for j in locations[keys[k]]]
+
+        loc_orders = _serpentine_orders(loc_xs, loc_ys)
+        loc_orders.append(_sweep_order(list(range(len(keys))), loc_xs, loc_ys, x0, y0))
+        if len(keys) <= exact_block_size:
+            loc_orders.extend(permutations(range(len(keys))))
+        greedy = _nearest_neighbor_order(loc_xs, loc_ys, x0, y0, simultaneous, search_deadline, min_cell)
+        loc_orders.append(_two_opt(greedy, loc_xs, loc_ys, x0, y0, simultaneous, search_deadline, min_cell))
+        candidates = [list(range(len(points)))] + [expand(order) for order in loc_orders]
+        best = min(candidates, key=lambda order: _path_time(order, xs, ys, x0, y0, simultaneous))
+
+        # Fill the scan point slots in path order; the entries around them stay where they are
+        for slot, j in zip(block, best):
+            result[slot] = points[j]
+        block.clear()
+
+    for i, entry in enumerate(positions):
+        if _is_scan_point(entry):
+            block.append(i)
+        elif isinstance(entry, dict) and entry.get('home'):
+            flush_block()
+            pos_a, pos_b = start_pos_a, start_pos_b
+    flush_block()
+
+    optimized = estimate_scan_time(result, start, simultaneous, step_delay_a, step_delay_b)
+    if optimized >= original:
+        return list(positions), original, original
+    return result, original, optimized
+
+def interpret_command(positions, optimize=False, start=None):
     """
     Args:
         positions (list or dict): A list of dictionaries or a single dictionary specifying the positions to move the motors.
@@ -38,6 +441,10 @@ def interpret_command(positions):
                 - 'home' (bool): If True, the motors will be homed.
                 - 'pos_a' (int or float): The absolute position to move motor A.
                 - 'pos_b' (int or float): The absolute position to move motor B.
+        optimize (bool): If True, the scan points are reordered with optimize_scan_order before moving.
+        start (tuple): (pos_a, pos_b) of the motors before the scan, used by the optimizer. If omitted and
+            the list does not begin with a homing entry, it is read with GETPOS. If that fails, the
+            motors are assumed to be at the homed start position.
     Returns:
         str: "success" if all commands are executed successfully, otherwise an error message.
     Raises:
@@ -54,6 +461,16 @@ def interpret_command(positions):
         if not isinstance(positions, list):
             positions = [positions]  # Ensure positions is a list
 
+        if optimize:
+            starts_homed = bool(positions) and isinstance(positions[0], dict) and positions[0].get('home')
+            if start is None and not starts_homed:
+                start = get_current_position()
+                if start is None:
+                    print("Could not read current position. Assuming the motors are at the homed start position.")
+            positions, original_time, optimized_time = optimize_scan_order(positions, start)
+            print(f"Estimated travel time: {original_time:.1f} s -> {optimized_time:.1f} s "
+                  f"(saved {original_time - optimized_time:.1f} s)")
+
         for entry in positions:
             if isinstance(entry, dict) and 'home' in entry and entry['home']:
                 response_home = send_command("HOME")
@@ -0,0 +1,119 @@
+"""
+Self-check for the scan order optimizer in arduino_coms.py. No Arduino is needed.
+
+Run with:
+    python test_scan_order.py
+"""
+import random
+import time
+from itertools import permutations
+
+import arduino_coms as ac
+
+def random_points(n, rng):
+    return [{'pos_a': rng.randint(0, 5800), 'pos_b': rng.randint(0, 2000)} for _ in range(n)]
+
+def check_result(positions, ordered, before, after, start=None, simultaneous=None):
+    """
+    Check that ordered is a valid reordering of positions and that the reported times are correct.
+    """
+    assert len(ordered) == len(positions)
+    assert sorted(map(id, ordered)) == sorted(map(id, positions)), "Output is not a permutation of the input"
+    for original, entry in zip(positions, ordered):
+        if not ac._is_scan_point(original):
+            assert entry is original, "Non-point entry moved"
+    # Scan points must stay between the same homing entries
+    homes = [i for i, entry in enumerate(positions) if isinstance(entry, dict) and entry.get('home')]
+    bounds = [0] + homes + [len(positions)]
+    for lo, hi in zip(bounds, bounds[1:]):
+        assert sorted(map(id, ordered[lo:hi])) == sorted(map(id, positions[lo:hi])), "Point crossed a homing entry"
+    assert abs(before - ac.estimate_scan_time(positions, start, simultaneous)) < 1e-9
+    assert abs(after - ac.estimate_scan_time(ordered, start, simultaneous)) < 1e-9
+    assert after <= before, f"Optimized order is slower: {before} -> {after}"
+
+def time_bound(positions, time_limit):
+    """
+    Allowed run time: the search stops at time_limit, but the work around it scales with the machine,
+    so allow a generous multiple of one measured linear pass over the list.
+    """
+    t = time.perf_counter()
+    ac.estimate_scan_time(positions)
+    linear = time.perf_counter() - t
+    return time_limit + 30 * linear + 0.1
+
+def optimize_timed(positions, time_limit=0.3):
+    bound = time_bound(positions, time_limit)
+    t = time.perf_counter()
+    ordered, before, after = ac.optimize_scan_order(positions, time_limit=time_limit)
+    elapsed = time.perf_counter() - t
+    assert elapsed < bound, f"Optimization of {len(positions)} points took {elapsed:.2f} s, allowed {bound:.2f} s"
+    return ordered, before, after
+
+def test_non_point_entry_regression():
+    positions = [{'pos_a': 10, 'pos_b': 0}, {'pos_a': 0, 'pos_b': 9}, {'note': 'x'}, {'pos_a': 0, 'pos_b': 100}]
+    ordered, before, after = ac.optimize_scan_order(positions, start=(0, 0))
+    check_result(positions, ordered, before, after, start=(0, 0))
+
+def test_mixed_entries():
+    rng = random.Random(1)
+    for trial in range(50):
+        positions = []
+        for _ in range(rng.randint(0, 40)):
+            kind = rng.random()
+            if kind < 0.1:
+                positions.append({'home': True})
+            elif kind < 0.2:
+                positions.append({'note': len(positions)})
+            else:
+                positions.extend(random_points(1, rng))
+        start = (rng.randint(0, 5800), rng.randint(0, 2000))
+        for simultaneous in (False, True):
+            ordered, before, after = ac.optimize_scan_order(positions, start=start, simultaneous=simultaneous)
+            check_result(positions, ordered, before, after, start, simultaneous)
+
+def test_brute_force():
+    rng = random.Random(2)
+    for n in range(1, 7):
+        for simultaneous in (False, True):
+            positions = random_points(n, rng)
+            start = (rng.randint(0, 5800), rng.randint(0, 2000))
+            ordered, before, after = ac.optimize_scan_order(positions, start=start, simultaneous=simultaneous)
+            check_result(positions, ordered, before, after, start, simultaneous)
+            best = min(ac.estimate_scan_time(list(order), start, simultaneous) for order in permutations(positions))
+            assert abs(after - best) < 1e-9, f"n={n}: {after} != brute force {best}"
+
+def test_large_lists():
+    rng = random.Random(3)
+    grid = [{'pos_a': a, 'pos_b': b} for a in range(0, 5800, 100) for b in range(0, 2000, 50)]
+    rng.shuffle(grid)
+    # A dense cluster with one distant outlier, and sub-step positions in a tiny area
+    cluster = [{'pos_a': rng.randint(0, 100), 'pos_b': rng.randint(0, 100)} for _ in range(10000)]
+    cluster.append({'pos_a': 5800, 'pos_b': 2000})
+    fine = [{'pos_a': rng.uniform(0, 3), 'pos_b': rng.uniform(0, 3)} for _ in range(5000)]
+    # Each case with the minimum expected ratio of original to optimized travel time
+    cases = [(random_points(5000, rng), 10), (random_points(20000, rng), 10), (grid, 10), (cluster, 3), (fine, 3)]
+    for positions, min_ratio in cases:
+        ordered, before, after = optimize_timed(positions)
+        check_result(positions, ordered, before, after)
+        assert after < before / min_ratio, f"Expected a large saving: {before} -> {after}"
+
+def test_repeated_locations():
+    # Repeated measurements at a few spots, one step apart
+    cases = [
+        [{'pos_a': i % 2, 'pos_b': 0} for i in range(10000)],
+        [{'pos_a': 100 + 2 * (i % 2), 'pos_b': 100} for i in range(1000)],
+        [{'pos_a': 5, 'pos_b': 5} for _ in range(10000)],
+    ]
+    for positions in cases:
+        ordered, before, after = optimize_timed(positions)
+        check_result(positions, ordered, before, after)
+        # Visiting each spot once and taking all its measurements there is optimal
+        spots = {(entry['pos_a'], entry['pos_b']) for entry in positions}
+        best = min(ac.estimate_scan_time([{'pos_a': a, 'pos_b': b} for a, b in order]) for order in permutations(spots))
+        assert abs(after - best) < 1e-9, f"{after} != {best}"
+
+if __name__ == "__main__":
+    for test in (test_non_point_entry_regression, test_mixed_entries, test_brute_force, test_large_lists,
+                 test_repeated_locations):
+        test()
+        print(f"{test.__name__}: ok")